@@ -40,12 +40,18 @@
 #include "MteMkeEnc.h"
 #include "MteMkeDec.h"
 #include "MteRandom.h"
+#include "lz4frame.h"
 #include <iostream>
 #include <fstream>
 #include <cstring>
 #include <cstdint>
 #include <vector>
+#include <deque>
+#include <algorithm>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
  // The path separator character, for Windows use "\\", other operating systems it will be "/".
     // Platform dependent path separator.
@@ -61,6 +67,29 @@ const char Separator = '/';
 const size_t encryptChunkSize = 1024;
 const size_t decryptChunkSize = 516;
 
+// Compress the file with LZ4 before encryption and decompress it after decryption.
+// Set to false to encrypt the raw file bytes. The container flag header records
+// which was used, so the decoder does not need to be told.
+const bool compressFile = true;
+
+// The LZ4 block size. The file is read in blocks of this size, so each compress
+// update produces about one compressed block, and decompressed output is written
+// a block at a time. The compressed blocks are still encrypted in chunks of
+// encryptChunkSize.
+const LZ4F_blockSizeID_t compressBlockSizeId = LZ4F_max64KB;
+const size_t compressBlockSize = static_cast<size_t>(1) << (8 + 2 * compressBlockSizeId);
+
+// The maximum number of chunks held between two pipeline stages.
+const size_t pipelineDepth = 8;
+
+// The container flag header written ahead of the encrypted data.
+const size_t containerHeaderSize = 4;
+const char containerMagic[3] = { 'M', 'K', 'C' };
+// Any other flag bit is reserved, and a header using one is rejected rather than
+// decoded the wrong way.
+const uint8_t containerFlagCompressed = 0x01;
+const uint8_t containerKnownFlags = containerFlagCompressed;
+
 
 class Cbs : public MteBase::EntropyCallback,
     public MteBase::NonceCallback,
@@ -75,7 +104,26 @@ private:
     virtual MTE_UINT64_T timestampCallback();
 };
 
+// Bounded queue used to hand chunks from one pipeline stage to the next.
+class ChunkQueue
+{
+public:
+    explicit ChunkQueue(size_t capacity);
+    bool push(std::vector<char>&& chunk);
+    bool pop(std::vector<char>& chunk);
+    void close();
+private:
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<std::vector<char>> chunks;
+    size_t capacity;
+    bool closed;
+};
+
 static uint64_t getTimestamp();
+static bool readAndCompress(std::ifstream& inputFile, bool compress, ChunkQueue& queue);
+static bool decompressAndWrite(std::ofstream& decodedFile, bool compressed, ChunkQueue& queue);
 
 uint64_t nonce;
 uint8_t* entropy;
@@ -243,22 +291,40 @@ int main()
             return status;
         }
 
-        // Go through until the end of the input file.
-        while (!inputFile.eof())
-        {
-            // Create buffer to hold encrypt chunk size.
-            char encryptChunkBuf[encryptChunkSize];
-
-            // Read a portion of the input file of size encryptChunkSize to the encryption buffer.
-            inputFile.read(encryptChunkBuf, encryptChunkSize);
-
-            // The amount read from the stream.
-            std::streamsize amountRead = inputFile.gcount();
+        // Write the container flag header ahead of the encrypted data.
+        char containerHeader[containerHeaderSize];
+        memcpy(containerHeader, containerMagic, sizeof(containerMagic));
+        containerHeader[3] = static_cast<char>(compressFile ? containerFlagCompressed : 0);
+        encodedFile.write(containerHeader, containerHeaderSize);
+
+        // Read and compress the input file on its own thread, so the next chunk
+        // is being prepared while the current one is encrypted and written.
+        ChunkQueue plainChunks(pipelineDepth);
+        bool compressSucceeded = true;
+        std::thread compressStage([&]()
+            {
+                compressSucceeded = readAndCompress(inputFile, compressFile, plainChunks);
+                plainChunks.close();
+            });
 
-            // Encrypt the chunk buffer.
-            status = encoder.encryptChunk(encryptChunkBuf, amountRead);
+        // Go through until the compression stage has no more chunks.
+        std::vector<char> plainChunk;
+        while (plainChunks.pop(plainChunk))
+        {
+            // Encrypt the chunk in pieces of encryptChunkSize.
+            for (size_t offset = 0; offset < plainChunk.size(); offset += encryptChunkSize)
+            {
+                size_t encryptBytes = std::min(encryptChunkSize, plainChunk.size() - offset);
+                status = encoder.encryptChunk(plainChunk.data() + offset, encryptBytes);
+                if (status != mte_status_success)
+                {
+                    break;
+                }
+            }
             if (status != mte_status_success)
             {
+                plainChunks.close();
+                compressStage.join();
                 std::cerr << "Error encrypting chunk: ("
                     << MteBase::getStatusName(status)
                     << "): "
@@ -267,9 +333,13 @@ int main()
                 return status;
             }
 
-            // Write the chunk buffer to the encoded file.
-            encodedFile.write(encryptChunkBuf, amountRead);
-            encodedFile.flush();
+            // Write the encrypted chunk to the encoded file.
+            encodedFile.write(plainChunk.data(), plainChunk.size());
+        }
+        compressStage.join();
+        if (!compressSucceeded)
+        {
+            return -1;
         }
 
         // Close the input file.
@@ -333,6 +403,36 @@ int main()
         std::ifstream encodedInputFile;
         encodedInputFile.open(encodedFileName, std::ifstream::in | std::ifstream::binary);
 
+        // Read and check the container flag header.
+        encodedInputFile.read(containerHeader, containerHeaderSize);
+        if (encodedInputFile.gcount() != static_cast<std::streamsize>(containerHeaderSize) ||
+            memcmp(containerHeader, containerMagic, sizeof(containerMagic)) != 0)
+        {
+            std::cerr << "Encoded file is missing the container header." << std::endl;
+            return -1;
+        }
+        uint8_t containerFlags = static_cast<uint8_t>(containerHeader[3]);
+        if ((containerFlags & ~containerKnownFlags) != 0)
+        {
+            std::cerr << "Encoded file has unsupported container flags." << std::endl;
+            return -1;
+        }
+        bool compressed = (containerFlags & containerFlagCompressed) != 0;
+
+        // Decompress and write the decrypted data on its own thread, so the next
+        // chunk is being decrypted while the current one is decompressed.
+        ChunkQueue decryptedChunks(pipelineDepth);
+        bool decompressSucceeded = true;
+        std::thread decompressStage([&]()
+            {
+                decompressSucceeded = decompressAndWrite(decodedFile, compressed, decryptedChunks);
+            });
+
+        // Collect decrypted bytes into blocks before handing them on, so the
+        // decompression stage is not handed one small chunk at a time.
+        std::vector<char> decryptedBlock;
+        decryptedBlock.reserve(compressBlockSize);
+
         // Go through until the end of the input file.
         while (!encodedInputFile.eof())
         {
@@ -349,24 +449,38 @@ int main()
             size_t decryptedBytes = 0;
             const void* decryptedChunk = decoder.decryptChunk(decryptChunkBuf, amountRead, decryptedBytes);
 
-            // If there are any bytes decrypted, write that to the decoded file.
-            if (decryptedBytes > 0)
+            // Copy any decrypted bytes into the block, since the decrypted chunk is
+            // only valid until the next decrypt call. Hand the block on once full.
+            const char* chunkBytes = static_cast<const char*>(decryptedChunk);
+            decryptedBlock.insert(decryptedBlock.end(), chunkBytes, chunkBytes + decryptedBytes);
+            if (decryptedBlock.size() >= compressBlockSize)
             {
-                // Write the chunk buffer to the decoded file.
-                decodedFile.write(static_cast<const char*>(decryptedChunk), decryptedBytes);
-                decodedFile.flush();
+                if (!decryptedChunks.push(std::move(decryptedBlock)))
+                {
+                    break;
+                }
+                decryptedBlock = std::vector<char>();
+                decryptedBlock.reserve(compressBlockSize);
             }
         }
 
         // Finish MKE decryption.
         size_t decryptedBytes = 0;
         const void* decryptedChunk = decoder.finishDecrypt(decryptedBytes, status);
-        // If there are any bytes decrypted, write that to the decoded file.
-        if (decryptedBytes > 0)
+        // Hand the last block, with any bytes decrypted, to the decompression stage.
+        const char* chunkBytes = static_cast<const char*>(decryptedChunk);
+        decryptedBlock.insert(decryptedBlock.end(), chunkBytes, chunkBytes + decryptedBytes);
+        if (!decryptedBlock.empty())
         {
-            // Write the chunk buffer to the decoded file.
-            decodedFile.write(static_cast<const char*>(decryptedChunk), decryptedBytes);
-            decodedFile.flush();
+            decryptedChunks.push(std::move(decryptedBlock));
+        }
+
+        // Let the decompression stage drain and wait for it.
+        decryptedChunks.close();
+        decompressStage.join();
+        if (!decompressSucceeded)
+        {
+            return -1;
         }
 
         // Close the encoded file.
@@ -423,6 +537,47 @@ MTE_UINT64_T Cbs::timestampCallback()
     return 0;
 }
 
+ChunkQueue::ChunkQueue(size_t capacity) : capacity(capacity), closed(false)
+{
+}
+
+bool ChunkQueue::push(std::vector<char>&& chunk)
+{
+    // Wait for room, unless the other stage has stopped.
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this]() { return closed || chunks.size() < capacity; });
+    if (closed)
+    {
+        return false;
+    }
+    chunks.push_back(std::move(chunk));
+    notEmpty.notify_one();
+    return true;
+}
+
+bool ChunkQueue::pop(std::vector<char>& chunk)
+{
+    // Wait for a chunk. Once closed, remaining chunks are still handed out.
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this]() { return closed || !chunks.empty(); });
+    if (chunks.empty())
+    {
+        return false;
+    }
+    chunk = std::move(chunks.front());
+    chunks.pop_front();
+    notFull.notify_one();
+    return true;
+}
+
+void ChunkQueue::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+}
+
 static uint64_t getTimestamp()
 {
     uint64_t ts;
@@ -438,4 +593,164 @@ static uint64_t getTimestamp()
     ts = 0;
 #endif 
     return ts;
-}
\ No newline at end of file
+}
+
+static bool readAndCompress(std::ifstream& inputFile, bool compress, ChunkQueue& queue)
+{
+    // Create buffer to hold one block of the input file.
+    std::vector<char> readBuf(compressBlockSize);
+
+    if (!compress)
+    {
+        // Hand the raw file bytes straight to the encryption stage.
+        while (!inputFile.eof())
+        {
+            inputFile.read(readBuf.data(), readBuf.size());
+            std::streamsize amountRead = inputFile.gcount();
+            if (amountRead > 0 && !queue.push(std::vector<char>(readBuf.data(), readBuf.data() + amountRead)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Use a content checksum so corruption is caught on decompress.
+    LZ4F_preferences_t preferences;
+    memset(&preferences, 0, sizeof(preferences));
+    preferences.frameInfo.blockSizeID = compressBlockSizeId;
+    preferences.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+
+    LZ4F_cctx* context = nullptr;
+    size_t result = LZ4F_createCompressionContext(&context, LZ4F_VERSION);
+    if (LZ4F_isError(result))
+    {
+        std::cerr << "Error creating compression context: "
+            << LZ4F_getErrorName(result) << std::endl;
+        return false;
+    }
+
+    // The compressed output goes to one scratch buffer large enough for any
+    // single call, and only the bytes produced are copied into each chunk.
+    std::vector<char> compressBuf(LZ4F_compressBound(compressBlockSize, &preferences));
+
+    // Start the LZ4 frame.
+    result = LZ4F_compressBegin(context, compressBuf.data(), compressBuf.size(), &preferences);
+    bool succeeded = !LZ4F_isError(result);
+    if (succeeded)
+    {
+        succeeded = queue.push(std::vector<char>(compressBuf.data(), compressBuf.data() + result));
+    }
+
+    // Go through until the end of the input file.
+    while (succeeded && !inputFile.eof())
+    {
+        inputFile.read(readBuf.data(), readBuf.size());
+        std::streamsize amountRead = inputFile.gcount();
+        if (amountRead <= 0)
+        {
+            continue;
+        }
+
+        result = LZ4F_compressUpdate(context, compressBuf.data(), compressBuf.size(),
+            readBuf.data(), amountRead, nullptr);
+        if (LZ4F_isError(result))
+        {
+            succeeded = false;
+        }
+        else if (result > 0)
+        {
+            succeeded = queue.push(std::vector<char>(compressBuf.data(), compressBuf.data() + result));
+        }
+    }
+
+    // Flush the last block and end the LZ4 frame.
+    if (succeeded)
+    {
+        result = LZ4F_compressEnd(context, compressBuf.data(), compressBuf.size(), nullptr);
+        succeeded = !LZ4F_isError(result);
+        if (succeeded && result > 0)
+        {
+            succeeded = queue.push(std::vector<char>(compressBuf.data(), compressBuf.data() + result));
+        }
+    }
+
+    if (LZ4F_isError(result))
+    {
+        std::cerr << "Error compressing file: "
+            << LZ4F_getErrorName(result) << std::endl;
+    }
+    LZ4F_freeCompressionContext(context);
+    return succeeded;
+}
+
+static bool decompressAndWrite(std::ofstream& decodedFile, bool compressed, ChunkQueue& queue)
+{
+    std::vector<char> chunk;
+
+    if (!compressed)
+    {
+        // Write the decrypted bytes straight to the decoded file.
+        while (queue.pop(chunk))
+        {
+            decodedFile.write(chunk.data(), chunk.size());
+        }
+        return true;
+    }
+
+    LZ4F_dctx* context = nullptr;
+    size_t result = LZ4F_createDecompressionContext(&context, LZ4F_VERSION);
+    if (LZ4F_isError(result))
+    {
+        std::cerr << "Error creating decompression context: "
+            << LZ4F_getErrorName(result) << std::endl;
+        queue.close();
+        return false;
+    }
+
+    // Decompress a block at a time. The decompressor returns 0 once the whole
+    // frame has been decoded.
+    std::vector<char> decompressBuf(compressBlockSize);
+    size_t remainingHint = 1;
+    bool succeeded = true;
+    while (succeeded && queue.pop(chunk))
+    {
+        size_t position = 0;
+        while (position < chunk.size())
+        {
+            size_t decompressedBytes = decompressBuf.size();
+            size_t consumedBytes = chunk.size() - position;
+            result = LZ4F_decompress(context, decompressBuf.data(), &decompressedBytes,
+                chunk.data() + position, &consumedBytes, nullptr);
+            if (LZ4F_isError(result))
+            {
+                std::cerr << "Error decompressing file: "
+                    << LZ4F_getErrorName(result) << std::endl;
+                succeeded = false;
+                break;
+            }
+            position += consumedBytes;
+            remainingHint = result;
+
+            // Write the decompressed bytes to the decoded file.
+            if (decompressedBytes > 0)
+            {
+                decodedFile.write(decompressBuf.data(), decompressedBytes);
+            }
+        }
+    }
+
+    if (succeeded && remainingHint != 0)
+    {
+        std::cerr << "Error decompressing file: compressed data is truncated." << std::endl;
+        succeeded = false;
+    }
+
+    // Stop the decryption stage if decompression failed part way.
+    if (!succeeded)
+    {
+        queue.close();
+    }
+    LZ4F_freeDecompressionContext(context);
+    return succeeded;
+}
@@ -25,9 +25,11 @@
 #include "MteEnc.h"
 #include "MteDec.h"
 
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -35,6 +37,105 @@
 #  pragma warning(disable:4996)
 #endif
 
+// Wraps a decoder and records how far ahead or behind in the sequence each
+// message lands, so the sequence window can be sized from the traffic actually
+// seen instead of being hard-coded. A window that is too small rejects valid
+// messages with seq_outside_window, and one that is too large costs extra
+// lookahead on every decode.
+class MteSeqTunedDec
+{
+public:
+    // Histogram buckets: 0, 1, 2-3, 4-7, ..., 64 and above.
+    static const size_t bucketCount = 8;
+
+    MteSeqTunedDec(uint64_t timestampWindow, int32_t sequenceWindow, bool autoTune);
+
+    // The wrapped decoder, for anything not wrapped here. A retune or a new
+    // session replaces it, so do not hold on to the reference.
+    MteDec& decoder();
+
+    // Instantiate a new decoder with the recommended window, as at the start
+    // of a session when the encoder is instantiated again with the same
+    // entropy, nonce, and personalization. This always applies the
+    // recommendation, even when retune() cannot carry the state over.
+    mte_status startSession(const void* entropy, size_t entropyBytes,
+        uint64_t nonce, const std::string& personal);
+
+    // Decode and record the sequence distance or rejection.
+    mte_status decodeB64(const char* encoded, std::string& decoded);
+
+    // Save and restore the wrapped decoder's state. The saved copy records
+    // the sequence window and size it was saved with. Restoring it rebuilds
+    // the decoder with that window if a retune changed it since, and is
+    // refused if the state size does not match.
+    std::vector<uint8_t> saveState();
+    mte_status restoreState(const std::vector<uint8_t>& saved);
+
+    // The current and the recommended sequence window. The recommendation
+    // keeps the sign of the current window and stays at the current window
+    // until enough messages have been seen, unless messages are rejected. In
+    // async mode it covers both how far ahead and how far behind messages
+    // arrive. It never drops to a window that has already rejected messages.
+    int32_t getSeqWindow() const;
+    int32_t recommendSeqWindow() const;
+
+    // Messages skipped over and never seen, as a fraction of the sequence
+    // covered. Messages that arrive late are not counted as lost.
+    double getLossRate() const;
+
+    // Reconstruct the decoder with the recommended window, carrying its state
+    // over, and start a new observation period. The saved state is sized from
+    // the decoder settings, which include the sequence window, so the retune
+    // is refused if the two windows do not save the same number of bytes;
+    // this is the usual case for async windows, which then take the
+    // recommendation at the next startSession(). A refused retune keeps the
+    // statistics and backs off before auto-tuning tries again.
+    mte_status retune();
+
+    // Print the collected statistics.
+    void printStats(std::ostream& out) const;
+
+private:
+    static void record(uint32_t* histogram, uint32_t distance);
+    static uint32_t coveredDistance(const uint32_t* histogram);
+    mte_status moveState(int32_t window, const void* state, size_t stateBytes);
+    void resetStats();
+
+    // Messages to observe before a window is recommended.
+    static const uint32_t minSamples = 32;
+
+    // Fraction of observed distances the recommended window must cover.
+    static const uint32_t coveragePercent = 99;
+
+    // Bytes ahead of the decoder state in a saved copy: window and size.
+    static const size_t savedHeaderBytes = sizeof(int32_t) + sizeof(uint32_t);
+
+    std::unique_ptr<MteDec> myDecoder;
+    uint64_t myTimestampWindow;
+    int32_t mySequenceWindow;
+    bool myAutoTune;
+
+    // Statistics for the current observation period. The high-water mark is
+    // the number of sequence positions covered by messages that advanced it.
+    uint32_t myAhead[bucketCount];
+    uint32_t myBehind[bucketCount];
+    uint64_t myHighWater;
+    uint64_t mySkipped;
+    uint32_t myDecoded;
+    uint32_t myLate;
+    uint32_t myOutsideWindow;
+    uint32_t myAsyncReplay;
+    uint32_t myOtherErrors;
+
+    // Kept across observation periods.
+    uint32_t myRejectionFloor;
+    uint32_t myRetuneFailures;
+    uint32_t myRetuneBackoff;
+};
+
+static mte_status encodeStream(MteEnc& encoder, size_t count, std::vector<std::string>& stream);
+static void deliverJittered(MteSeqTunedDec& decoder, const std::vector<std::string>& stream);
+
 int main(int /*argc*/, char** /*argv*/)
 {
     // Status.
@@ -243,8 +344,454 @@ int main(int /*argc*/, char** /*argv*/)
     std::cout << "Decode #1: " << MteBase::getStatusName(status)
         << ", " << decoded << std::endl;
 
+    // Encode a longer stream to tune a decoder against.
+    std::vector<std::string> stream;
+    status = encodeStream(encoder, 64, stream);
+    if (status != mte_status_success)
+    {
+        return status;
+    }
+
+    // Create an async decoder with an oversized window that tunes itself.
+    MteSeqTunedDec decoderT(0, -32, true);
+    status = decoderT.startSession(entropy, entropyBytes, 0, personal);
+    if (status != mte_status_success)
+    {
+        std::cerr << "Decoder instantiate error ("
+            << MteBase::getStatusName(status)
+            << "): "
+            << MteBase::getStatusDescription(status)
+            << std::endl;
+        return status;
+    }
+
+    // Decode the first four messages in order, then the rest of the stream
+    // over a jittery link.
+    std::cout << "\nTuned async mode (sequence window = "
+        << decoderT.getSeqWindow() << "):" << std::endl;
+    for (size_t i = 0; i < encodings.size(); ++i)
+    {
+        decoderT.decodeB64(encodings[i].c_str(), decoded);
+    }
+    deliverJittered(decoderT, stream);
+    decoderT.printStats(std::cout);
+
+    // Start a new session. The encoder is instantiated again, and the tuned
+    // decoder is instantiated with the recommended window.
+    MteEnc encoder2;
+    encoder2.setEntropy(entropy, entropyBytes);
+    encoder2.setNonce(1);
+    status = encoder2.instantiate(personal);
+    if (status == mte_status_success)
+    {
+        status = decoderT.startSession(entropy, entropyBytes, 1, personal);
+    }
+    if (status != mte_status_success)
+    {
+        std::cerr << "New session instantiate error ("
+            << MteBase::getStatusName(status)
+            << "): "
+            << MteBase::getStatusDescription(status)
+            << std::endl;
+        return status;
+    }
+    status = encodeStream(encoder2, 64, stream);
+    if (status != mte_status_success)
+    {
+        return status;
+    }
+    std::cout << "\nTuned async mode, new session (sequence window = "
+        << decoderT.getSeqWindow() << "):" << std::endl;
+    deliverJittered(decoderT, stream);
+    decoderT.printStats(std::cout);
+
     // Success.
     delete[] entropy;
     return 0;
 }
 
+static mte_status encodeStream(MteEnc& encoder, size_t count, std::vector<std::string>& stream)
+{
+    mte_status status = mte_status_success;
+    stream.clear();
+    for (size_t i = 0; i < count; ++i)
+    {
+        const char* encoded = encoder.encodeB64("stream message " + std::to_string(i), status);
+        if (status != mte_status_success)
+        {
+            std::cerr << "Encode error ("
+                << MteBase::getStatusName(status)
+                << "): "
+                << MteBase::getStatusDescription(status)
+                << std::endl;
+            return status;
+        }
+        stream.push_back(encoded);
+    }
+    return status;
+}
+
+static void deliverJittered(MteSeqTunedDec& decoder, const std::vector<std::string>& stream)
+{
+    // Every fourth pair of messages swaps places and every tenth message is lost.
+    std::string decoded;
+    for (size_t i = 0; i < stream.size(); ++i)
+    {
+        size_t j = i;
+        if (i % 8 == 0 && i + 1 < stream.size())
+        {
+            j = i + 1;
+        }
+        else if (i % 8 == 1)
+        {
+            j = i - 1;
+        }
+        if (j % 10 == 9)
+        {
+            continue;
+        }
+        decoder.decodeB64(stream[j].c_str(), decoded);
+    }
+}
+
+MteSeqTunedDec::MteSeqTunedDec(uint64_t timestampWindow, int32_t sequenceWindow, bool autoTune) :
+    myDecoder(new MteDec(timestampWindow, sequenceWindow)),
+    myTimestampWindow(timestampWindow),
+    mySequenceWindow(sequenceWindow),
+    myAutoTune(autoTune),
+    myRejectionFloor(0),
+    myRetuneFailures(0),
+    myRetuneBackoff(0)
+{
+    resetStats();
+}
+
+MteDec& MteSeqTunedDec::decoder()
+{
+    return *myDecoder;
+}
+
+mte_status MteSeqTunedDec::startSession(const void* entropy, size_t entropyBytes,
+    uint64_t nonce, const std::string& personal)
+{
+    int32_t window = recommendSeqWindow();
+    std::unique_ptr<MteDec> session(new MteDec(myTimestampWindow, window));
+    session->setEntropy(entropy, entropyBytes);
+    session->setNonce(nonce);
+    mte_status status = session->instantiate(personal);
+    if (status != mte_status_success)
+    {
+        return status;
+    }
+    myDecoder.swap(session);
+    mySequenceWindow = window;
+    myRetuneBackoff = 0;
+    resetStats();
+    return mte_status_success;
+}
+
+mte_status MteSeqTunedDec::decodeB64(const char* encoded, std::string& decoded)
+{
+    mte_status status = myDecoder->decodeB64(encoded, decoded);
+    if (status == mte_status_success)
+    {
+        // A message behind the current sequence is reported as a negative skip.
+        int32_t skipped = static_cast<int32_t>(myDecoder->getMsgSkipped());
+        if (skipped < 0)
+        {
+            ++myLate;
+            record(myBehind, static_cast<uint32_t>(-static_cast<int64_t>(skipped)));
+        }
+        else
+        {
+            ++myDecoded;
+            myHighWater += static_cast<uint64_t>(skipped) + 1;
+            mySkipped += skipped;
+            record(myAhead, static_cast<uint32_t>(skipped));
+        }
+    }
+    else if (status == mte_status_seq_outside_window)
+    {
+        // The true distance is unknown, but it is beyond the current window,
+        // so never go back to this window.
+        ++myOutsideWindow;
+        uint32_t floor = static_cast<uint32_t>(mySequenceWindow < 0 ?
+            -static_cast<int64_t>(mySequenceWindow) : mySequenceWindow) + 1;
+        if (floor > myRejectionFloor)
+        {
+            myRejectionFloor = floor;
+        }
+    }
+    else if (status == mte_status_seq_async_replay)
+    {
+        ++myAsyncReplay;
+    }
+    else
+    {
+        ++myOtherErrors;
+    }
+
+    // Retune once enough messages have been seen. The message has already
+    // been decoded, so the retune result does not change the decode status.
+    if (myRetuneBackoff > 0)
+    {
+        --myRetuneBackoff;
+    }
+    else if (myAutoTune && recommendSeqWindow() != mySequenceWindow)
+    {
+        retune();
+    }
+    return status;
+}
+
+std::vector<uint8_t> MteSeqTunedDec::saveState()
+{
+    std::vector<uint8_t> saved;
+    size_t stateBytes = 0;
+    const uint8_t* state = static_cast<const uint8_t*>(myDecoder->saveState(stateBytes));
+    if (state == NULL)
+    {
+        return saved;
+    }
+
+    uint32_t size = static_cast<uint32_t>(stateBytes);
+    saved.resize(savedHeaderBytes + stateBytes);
+    memcpy(saved.data(), &mySequenceWindow, sizeof(mySequenceWindow));
+    memcpy(saved.data() + sizeof(mySequenceWindow), &size, sizeof(size));
+    memcpy(saved.data() + savedHeaderBytes, state, stateBytes);
+    return saved;
+}
+
+mte_status MteSeqTunedDec::restoreState(const std::vector<uint8_t>& saved)
+{
+    int32_t window;
+    uint32_t size;
+    if (saved.size() < savedHeaderBytes)
+    {
+        return mte_status_invalid_input;
+    }
+    memcpy(&window, saved.data(), sizeof(window));
+    memcpy(&size, saved.data() + sizeof(window), sizeof(size));
+    if (saved.size() != savedHeaderBytes + size)
+    {
+        return mte_status_invalid_input;
+    }
+    const uint8_t* state = saved.data() + savedHeaderBytes;
+
+    // Saved with a different window, so rebuild the decoder with that one.
+    if (window != mySequenceWindow)
+    {
+        mte_status status = moveState(window, state, size);
+        if (status == mte_status_success)
+        {
+            resetStats();
+        }
+        return status;
+    }
+
+    // Same window, but check the size before handing over the buffer.
+    size_t currentBytes = 0;
+    if (myDecoder->saveState(currentBytes) == NULL || currentBytes != size)
+    {
+        return mte_status_unsupported;
+    }
+    return myDecoder->restoreState(state);
+}
+
+int32_t MteSeqTunedDec::getSeqWindow() const
+{
+    return mySequenceWindow;
+}
+
+int32_t MteSeqTunedDec::recommendSeqWindow() const
+{
+    // Verification-only mode does not look ahead, so there is nothing to tune.
+    if (mySequenceWindow == 0)
+    {
+        return mySequenceWindow;
+    }
+
+    // Until enough messages have been seen, only a rejection moves the window.
+    uint32_t current = static_cast<uint32_t>(mySequenceWindow < 0 ?
+        -static_cast<int64_t>(mySequenceWindow) : mySequenceWindow);
+    bool enoughSamples = myDecoded + myLate >= minSamples;
+    if (!enoughSamples && myRejectionFloor <= current)
+    {
+        return mySequenceWindow;
+    }
+
+    // Async mode must also reach as far behind as messages arrive late.
+    // Neither mode goes back to a window that rejected messages.
+    uint32_t distance = current;
+    if (enoughSamples)
+    {
+        distance = coveredDistance(myAhead);
+        if (mySequenceWindow < 0)
+        {
+            uint32_t behind = coveredDistance(myBehind);
+            if (behind > distance)
+            {
+                distance = behind;
+            }
+        }
+    }
+    if (myRejectionFloor > distance)
+    {
+        distance = myRejectionFloor;
+    }
+
+    // Round up to a bucket upper bound, so there is some headroom.
+    int32_t window = 1;
+    while (static_cast<uint32_t>(window) < distance && window < (1 << (bucketCount - 1)) - 1)
+    {
+        window = window * 2 + 1;
+    }
+    return mySequenceWindow < 0 ? -window : window;
+}
+
+double MteSeqTunedDec::getLossRate() const
+{
+    // Late messages filled positions that were counted as skipped. Late
+    // messages skipped over in an earlier observation period can make them
+    // outnumber this period's skips.
+    uint64_t lost = mySkipped > myLate ? mySkipped - myLate : 0;
+    return myHighWater == 0 ? 0.0 : static_cast<double>(lost) / myHighWater;
+}
+
+mte_status MteSeqTunedDec::retune()
+{
+    int32_t window = recommendSeqWindow();
+    if (window == mySequenceWindow)
+    {
+        return mte_status_success;
+    }
+
+    // Copy the state out before another decoder is created.
+    size_t stateBytes = 0;
+    const uint8_t* saved = static_cast<const uint8_t*>(myDecoder->saveState(stateBytes));
+    mte_status status = mte_status_unsupported;
+    if (saved != NULL)
+    {
+        std::vector<uint8_t> state(saved, saved + stateBytes);
+        status = moveState(window, state.data(), state.size());
+    }
+    if (status != mte_status_success)
+    {
+        // Keep the statistics, so the recommendation stands, and wait longer
+        // after each refusal before trying again.
+        ++myRetuneFailures;
+        uint32_t shift = myRetuneFailures < 5 ? myRetuneFailures - 1 : 4;
+        myRetuneBackoff = minSamples << shift;
+        return status;
+    }
+
+    myRetuneBackoff = 0;
+    resetStats();
+    return mte_status_success;
+}
+
+mte_status MteSeqTunedDec::moveState(int32_t window, const void* state, size_t stateBytes)
+{
+    // restoreState() reads as many bytes as the restoring decoder saves, so
+    // instantiate the new decoder first and compare the save sizes. The
+    // throwaway entropy is replaced by the restored state.
+    std::unique_ptr<MteDec> moved(new MteDec(myTimestampWindow, window));
+    std::vector<uint8_t> entropy(MteBase::getDrbgsEntropyMinBytes(moved->getDrbg()));
+    moved->setEntropy(entropy.data(), entropy.size());
+    moved->setNonce(0);
+    mte_status status = moved->instantiate("");
+    if (status != mte_status_success)
+    {
+        return status;
+    }
+    size_t movedBytes = 0;
+    if (moved->saveState(movedBytes) == NULL || movedBytes != stateBytes)
+    {
+        return mte_status_unsupported;
+    }
+    status = moved->restoreState(state);
+    if (status != mte_status_success)
+    {
+        return status;
+    }
+    myDecoder.swap(moved);
+    mySequenceWindow = window;
+    return mte_status_success;
+}
+
+void MteSeqTunedDec::printStats(std::ostream& out) const
+{
+    static const char* const bucketNames[bucketCount] =
+    {
+      "0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+"
+    };
+    out << "Sequence window: " << mySequenceWindow
+        << " (recommended " << recommendSeqWindow()
+        << ", retunes refused " << myRetuneFailures << ")" << std::endl;
+    out << "Decoded: " << myDecoded
+        << ", late: " << myLate
+        << ", skipped: " << mySkipped
+        << ", loss rate: " << getLossRate() << std::endl;
+    out << "Rejected: " << myOutsideWindow << " outside window, "
+        << myAsyncReplay << " async replay, "
+        << myOtherErrors << " other" << std::endl;
+    out << "Distance ahead:";
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        out << " " << bucketNames[i] << "=" << myAhead[i];
+    }
+    out << std::endl;
+    out << "Distance behind:";
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        out << " " << bucketNames[i] << "=" << myBehind[i];
+    }
+    out << std::endl;
+}
+void MteSeqTunedDec::record(uint32_t* histogram, uint32_t distance)
+{
+    // Bucket by the number of bits needed to hold the distance.
+    size_t bucket = 0;
+    while (distance != 0 && bucket < bucketCount - 1)
+    {
+        distance >>= 1;
+        ++bucket;
+    }
+    ++histogram[bucket];
+}
+
+uint32_t MteSeqTunedDec::coveredDistance(const uint32_t* histogram)
+{
+    uint32_t samples = 0;
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        samples += histogram[i];
+    }
+
+    // Find the smallest bucket that covers enough of the observed distances
+    // and return its upper bound.
+    uint32_t covered = 0;
+    size_t bucket = 0;
+    for (; bucket < bucketCount - 1; ++bucket)
+    {
+        covered += histogram[bucket];
+        if (static_cast<uint64_t>(covered) * 100 >= static_cast<uint64_t>(samples) * coveragePercent)
+        {
+            break;
+        }
+    }
+    return (static_cast<uint32_t>(1) << bucket) - 1;
+}
+
+void MteSeqTunedDec::resetStats()
+{
+    memset(myAhead, 0, sizeof(myAhead));
+    memset(myBehind, 0, sizeof(myBehind));
+    myHighWater = 0;
+    mySkipped = 0;
+    myDecoded = 0;
+    myLate = 0;
+    myOutsideWindow = 0;
+    myAsyncReplay = 0;
+    myOtherErrors = 0;
+}